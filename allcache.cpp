@@ -37,152 +37,572 @@ END_LEGAL */
  *  instruction+data TLB+cache hieraries
  */
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "pin.H"
 
-typedef UINT32 CACHE_STATS; // type of cache hit/miss counters
+#include "allcache.H"
+#include "allcache_trace.H"
+
+KNOB<std::string> KnobRecordFile(KNOB_MODE_WRITEONCE, "pintool",
+    "record", "", "also record all cache references to this trace file for allcache_replay");
+KNOB<UINT32> KnobL2Stripes(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_stripes", "256", "number of locks protecting the shared UL2 sets (power of 2)");
+KNOB<std::string> KnobProfileFile(KNOB_MODE_WRITEONCE, "pintool",
+    "profile", "", "write UL2 miss-ratio curves for many sizes/associativities to this CSV file");
+KNOB<UINT32> KnobProfileMinSets(KNOB_MODE_WRITEONCE, "pintool",
+    "profile_min_sets", "1024", "smallest number of UL2 sets to profile (power of 2)");
+KNOB<UINT32> KnobProfileMaxSets(KNOB_MODE_WRITEONCE, "pintool",
+    "profile_max_sets", "16384", "largest number of UL2 sets to profile (power of 2)");
+KNOB<UINT32> KnobProfileMaxAssoc(KNOB_MODE_WRITEONCE, "pintool",
+    "profile_max_assoc", "16", "profile UL2 associativities 1 to this");
+KNOB<UINT64> KnobFastForward(KNOB_MODE_WRITEONCE, "pintool",
+    "ffwd", "0", "instructions to skip without simulation before each sample");
+KNOB<UINT64> KnobWarmup(KNOB_MODE_WRITEONCE, "pintool",
+    "warmup", "0", "instructions simulated but not counted before each measurement");
+KNOB<UINT64> KnobMeasure(KNOB_MODE_WRITEONCE, "pintool",
+    "measure", "0", "instructions measured per sample; 0 measures until exit, "
+    "otherwise ffwd/warmup/measure repeats");
+KNOB<std::string> KnobStatsFile(KNOB_MODE_WRITEONCE, "pintool",
+    "stats", "", "write a CSV record of the cache statistics every -stats_interval instructions to this file");
+KNOB<UINT64> KnobStatsInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "stats_interval", "10000000", "instructions per -stats record");
+KNOB<std::string> KnobCheckpointFile(KNOB_MODE_WRITEONCE, "pintool",
+    "checkpoint", "", "write the state of all caches to this file at -checkpoint_at instructions or on SIGUSR1");
+KNOB<UINT64> KnobCheckpointAt(KNOB_MODE_WRITEONCE, "pintool",
+    "checkpoint_at", "0", "instructions after which to write -checkpoint; 0 waits for SIGUSR1");
+KNOB<std::string> KnobRestoreFile(KNOB_MODE_WRITEONCE, "pintool",
+    "restore", "", "start from the cache state in this checkpoint, skipping the instructions it has seen");
+
+/*
+ * Instruction clock. When sampling or writing interval statistics, every
+ * basic block counts its instructions down from a private slice of at most
+ * CLOCK_QUANTUM. When a slice runs out it is added to the global count,
+ * which drives the sampling phases and the interval records, so both are
+ * accurate to a basic block for one thread and to a slice per thread
+ * otherwise.
+ *
+ * Sampling. Together all threads go through phases of -ffwd, -warmup and
+ * -measure instructions. Fast-forwarding only runs the clock; caches are
+ * flushed when simulation resumes and statistics of the warmup phase are
+ * dropped. Without any of the knobs everything is measured.
+ *
+ * Checkpoints. A checkpoint is written when the clock reaches -checkpoint_at
+ * or at the first tick after SIGUSR1. A restored run fast-forwards over the
+ * instructions the checkpoint has seen without flushing, then goes through
+ * the sampling phases as usual.
+ */
+typedef enum
+{
+    PHASE_FFWD,
+    PHASE_WARMUP,
+    PHASE_MEASURE,
+    PHASE_NUM
+} PHASE;
+
+const INT64 CLOCK_QUANTUM = 16 * KILO;
+
+LOCALVAR BOOL clocked = false;
+LOCALVAR PIN_LOCK clockLock;
+LOCALVAR UINT64 clockInstructions = 0;  // instructions executed by all threads
+LOCALVAR UINT64 nextInterval = ~UINT64(0);
+
+LOCALVAR BOOL sampling = false;
+LOCALVAR volatile PHASE phase = PHASE_MEASURE;
+LOCALVAR UINT64 phaseDone = 0;      // instructions executed in this phase
+LOCALVAR volatile UINT32 epoch = 0; // number of phase changes
+LOCALVAR UINT32 flushEpoch = 0;     // epoch of the last cache flush
+
+LOCALVAR UINT64 nextCheckpoint = ~UINT64(0);
+LOCALVAR volatile BOOL checkpointRequested = false;
+LOCALVAR CACHE_CHECKPOINT::READER restoreReader;
+LOCALVAR UINT64 restoreSkip = 0;    // instructions the restored caches have seen
+LOCALVAR BOOL restoring = false;    // in the fast-forward over them
+
+const ADDRINT IL1_LINE_MASK = ~ADDRINT(IL1::lineSize - 1);
+const ADDRINT DL1_LINE_MASK = ~ADDRINT(DL1::lineSize - 1);
+
+/*!
+ *  @brief Per-thread tool state, reached through a tool register
+ */
+class THREAD_DATA : public THREAD_CACHES
+{
+  public:
+    THREADID tid;
+
+    // the store in flight, so its lines can be recompressed once it is done
+    ADDRINT storeAddr;
+    UINT32 storeSize;
+
+    // phase this thread's caches and counters are in, see SyncPhase()
+    PHASE phase;
+    UINT32 epoch;
+
+    // instructions left in and size of the current sampling slice
+    INT64 budget;
+    INT64 granted;
+
+    THREAD_DATA(THREADID t)
+      : tid(t), storeAddr(0), storeSize(0),
+        phase(PHASE_MEASURE), epoch(0), budget(0), granted(0)
+    {}
+};
+
+LOCALVAR REG threadReg;
+LOCALVAR TLS_KEY threadKey;
 
-#include "pin_cache.H"
+// threads whose statistics have not been merged yet
+LOCALVAR PIN_LOCK threadsLock;
+LOCALVAR std::vector<THREAD_DATA *> liveThreads;
+
+LOCALVAR CACHE_TRACE::WRITER traceWriter;
+LOCALVAR PIN_LOCK traceLock;
+
+LOCALVAR INTERVAL_STATS intervalStats;
+
+LOCALFUN UINT64 PhaseLength(PHASE p)
+{
+    switch (p)
+    {
+      case PHASE_FFWD: return restoring ? restoreSkip : KnobFastForward.Value();
+      case PHASE_WARMUP: return KnobWarmup.Value();
+      default: return KnobMeasure.Value() != 0 ? KnobMeasure.Value() : ~UINT64(0);
+    }
+}
+
+LOCALFUN PHASE FollowingPhase(PHASE p)
+{
+    do
+    {
+        p = PHASE((p + 1) % PHASE_NUM);
+    }
+    while (PhaseLength(p) == 0);
+    return p;
+}
 
+/// Size of the next clock slice; clockLock must be held
+LOCALFUN INT64 Grant()
+{
+    UINT64 slice = std::min(PhaseLength(phase) - phaseDone, nextInterval - clockInstructions);
+    if (nextCheckpoint > clockInstructions) slice = std::min(slice, nextCheckpoint - clockInstructions);
+    return INT64(std::min(UINT64(CLOCK_QUANTUM), slice));
+}
 
-namespace IL1
+/// Switch to the following phase; clockLock must be held
+LOCALFUN VOID NextPhase()
 {
-    // 1st level instruction cache: 32 kB, 32 B lines, 32-way associative
-    const UINT32 cacheSize = 32*KILO;
-    const UINT32 lineSize = 32;
-    const UINT32 associativity = 32;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_NO_ALLOCATE;
+    const PHASE oldPhase = phase;
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = associativity;
+    phase = FollowingPhase(phase);
+    epoch++;
 
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
+    if (oldPhase == PHASE_FFWD && restoring)
+    {
+        // the restored caches have seen what was skipped
+        restoring = false;
+    }
+    else if (oldPhase == PHASE_FFWD)
+    {
+        // the caches have not seen what was skipped; per-thread L1s are
+        // flushed by their threads in SyncPhase()
+        flushEpoch = epoch;
+        ul2.Flush();
+        if (ul2Profiler != 0) ul2Profiler->Flush();
+        il1.IncFlushCounter();
+        dl1.IncFlushCounter();
+    }
+    else if (oldPhase == PHASE_WARMUP)
+    {
+        il1.IncResetCounter();
+        dl1.IncResetCounter();
+        ul2.IncResetCounter();
+    }
 }
-LOCALVAR IL1::CACHE il1("L1 Instruction Cache", IL1::cacheSize, IL1::lineSize, IL1::associativity);
 
+/*!
+ *  Bring the caches and counters of a thread to the current phase. Only
+ *  the thread itself may call this while it is running.
+ */
+LOCALFUN VOID SyncPhase(THREAD_DATA * td)
+{
+    PIN_GetLock(&clockLock, td->tid + 1);
+    const PHASE newPhase = phase;
+    const UINT32 newEpoch = epoch;
+    const BOOL flush = INT32(td->epoch - flushEpoch) < 0;
+    PIN_ReleaseLock(&clockLock);
+
+    if (td->epoch == newEpoch) return;
+
+    // interval records must not see the counters both merged and unreset
+    PIN_GetLock(&threadsLock, td->tid + 1);
+    if (td->phase == PHASE_MEASURE) MergeStats(td);
+    td->ResetStats();
+    PIN_ReleaseLock(&threadsLock);
+    if (flush) td->Flush();
+
+    td->phase = newPhase;
+    td->epoch = newEpoch;
+}
 
-namespace DL1
+LOCALFUN ADDRINT PIN_FAST_ANALYSIS_CALL CountDown(THREAD_DATA * td, UINT32 instructions)
 {
-    // 1st level data cache: 32 kB, 32 B lines, 32-way associative
-    const UINT32 cacheSize = 32*KILO;
-    const UINT32 lineSize = 32;
-    const UINT32 associativity = 32;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_NO_ALLOCATE;
+    td->budget -= instructions;
+    return td->budget <= 0;
+}
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = associativity;
+/// Write an interval record with the statistics of all threads so far
+LOCALFUN VOID RecordInterval(THREADID tid, UINT64 instructions)
+{
+    STATS_SNAPSHOT snapshot;
 
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
+    PIN_GetLock(&threadsLock, tid + 1);
+    snapshot.AddGlobal();
+    for (std::vector<THREAD_DATA *>::iterator it = liveThreads.begin(); it != liveThreads.end(); ++it)
+    {
+        // other threads keep counting; their 64-bit counters are read whole
+        if ((*it)->phase == PHASE_MEASURE) snapshot.Add(*it);
+    }
+    intervalStats.Record(instructions, snapshot);
+    PIN_ReleaseLock(&threadsLock);
 }
-LOCALVAR DL1::CACHE dl1("L1 Data Cache", DL1::cacheSize, DL1::lineSize, DL1::associativity);
 
+/*!
+ *  Write the state of all caches to the -checkpoint file. The other threads
+ *  are stopped so that their caches do not change while they are copied.
+ */
+LOCALFUN VOID WriteCheckpoint(THREAD_DATA * td, UINT64 instructions)
+{
+    const BOOL stopped = PIN_StopApplicationThreads(td->tid);
 
+    PIN_GetLock(&clockLock, td->tid + 1);
+    const UINT32 lastFlush = flushEpoch;
+    PIN_ReleaseLock(&clockLock);
 
+    STATS_SNAPSHOT snapshot;
+    CHECKPOINT_THREADS threads;
 
-namespace UL2
+    PIN_GetLock(&threadsLock, td->tid + 1);
+    snapshot.AddGlobal();
+    for (std::vector<THREAD_DATA *>::iterator it = liveThreads.begin(); it != liveThreads.end(); ++it)
+    {
+        if ((*it)->phase == PHASE_MEASURE) snapshot.Add(*it);
+
+        // L1s a thread has yet to flush hold nothing worth keeping
+        if (INT32((*it)->epoch - lastFlush) >= 0) threads.push_back(std::make_pair((*it)->tid, *it));
+    }
+    const BOOL saved = SaveCheckpoint(KnobCheckpointFile.Value(), instructions, snapshot, threads);
+    PIN_ReleaseLock(&threadsLock);
+
+    if (stopped) PIN_ResumeApplicationThreads(td->tid);
+
+    if (saved)
+    {
+        std::cerr << "allcache: wrote checkpoint after " << instructions << " instructions" << std::endl;
+    }
+    else
+    {
+        std::cerr << "allcache: cannot write checkpoint " << KnobCheckpointFile.Value() << std::endl;
+    }
+}
+
+/// SIGUSR1: write a checkpoint at the next clock tick
+LOCALFUN BOOL CheckpointSignal(THREADID tid, INT32 sig, CONTEXT * ctxt, BOOL hasHandler,
+                               const EXCEPTION_INFO * exception, VOID * v)
 {
-    // 2nd level unified cache: 2 MB, 64 B lines, 4 way compressed
-    const UINT32 cacheSize = 2*MEGA;
-    const UINT32 lineSize = 64;
-    const UINT32 associativity = 4;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+    checkpointRequested = true;
+    return false;
+}
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
+/*!
+ *  The slice of td ran out at the start of a block of instructions: account
+ *  for it, advance the phase, write an interval record or a checkpoint if
+ *  one is due and hand out the next slice.
+ */
+LOCALFUN VOID ClockTick(THREAD_DATA * td, UINT32 instructions, CONTEXT * ctxt)
+{
+    PIN_GetLock(&clockLock, td->tid + 1);
+    const PHASE oldPhase = phase;
+    const UINT64 consumed = td->granted - td->budget;
+
+    clockInstructions += consumed;
+    phaseDone += consumed;
+    while (phaseDone >= PhaseLength(phase))
+    {
+        phaseDone -= PhaseLength(phase);
+        NextPhase();
+    }
 
+    const UINT64 now = clockInstructions;
+    const BOOL intervalDone = now >= nextInterval;
+    if (intervalDone)
+    {
+        const UINT64 interval = KnobStatsInterval.Value();
+        nextInterval = (now / interval + 1) * interval;
+    }
+    const BOOL checkpointDue = now >= nextCheckpoint || checkpointRequested;
+    if (checkpointDue)
+    {
+        nextCheckpoint = ~UINT64(0);
+        checkpointRequested = false;
+    }
+    td->granted = td->budget = Grant();
 
-    typedef CACHE_LRU(max_sets,associativity,lineSize,allocation) CACHE;
+    const BOOL reinstrument = (oldPhase == PHASE_FFWD) != (phase == PHASE_FFWD);
+    PIN_ReleaseLock(&clockLock);
+
+    SyncPhase(td);
+    if (intervalDone) RecordInterval(td->tid, now);
+    if (checkpointDue) WriteCheckpoint(td, now);
+
+    if (reinstrument)
+    {
+        // restart this block with the new instrumentation, which counts it again
+        td->budget += instructions;
+        PIN_RemoveInstrumentation();
+        PIN_ExecuteAt(ctxt);
+    }
 }
-LOCALVAR UL2::CACHE ul2("L2 Unified Compressed Cache", UL2::cacheSize, UL2::lineSize, UL2::associativity);
 
-LOCALFUN VOID Fini(int code, VOID * v)
+LOCALFUN VOID ThreadStart(THREADID tid, CONTEXT * ctxt, INT32 flags, VOID * v)
 {
-    //std::cerr << itlb;
-    //std::cerr << dtlb;
-    std::cout << il1;
-    std::cout << dl1;
-    std::cout << ul2;
-    //std::cout << ul2.geteSize()*UL2::lineSize<<"KB"<<endl;
+    THREAD_DATA * td = new THREAD_DATA(tid);
+
+    PIN_GetLock(&clockLock, tid + 1);
+    td->phase = phase;
+    td->epoch = epoch;
+    td->granted = td->budget = Grant();
+    const BOOL restore = restoring;
+    PIN_ReleaseLock(&clockLock);
+
+    // threads started later did not exist when the checkpoint was taken
+    if (restore) RestoreThread(restoreReader, tid, td);
+
+    PIN_SetThreadData(threadKey, td, tid);
+    PIN_SetContextReg(ctxt, threadReg, reinterpret_cast<ADDRINT>(td));
+
+    PIN_GetLock(&threadsLock, tid + 1);
+    liveThreads.push_back(td);
+    PIN_ReleaseLock(&threadsLock);
 }
 
-LOCALFUN VOID Ul2Access(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+LOCALFUN VOID ThreadFini(THREADID tid, const CONTEXT * ctxt, INT32 code, VOID * v)
 {
-    // second level unified cache
-    //if(CACHE_BASE::)
-    ul2.SpecialAccess(addr, size, accessType);
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(threadKey, tid));
+
+    SyncPhase(td);
+
+    // the part of its slice the thread ran before exiting
+    PIN_GetLock(&clockLock, tid + 1);
+    clockInstructions += td->granted - td->budget;
+    PIN_ReleaseLock(&clockLock);
 
+    PIN_GetLock(&threadsLock, tid + 1);
+    for (std::vector<THREAD_DATA *>::iterator it = liveThreads.begin(); it != liveThreads.end(); ++it)
+    {
+        if (*it == td)
+        {
+            liveThreads.erase(it);
+            if (td->phase == PHASE_MEASURE) MergeStats(td);
+            delete td;
+            break;
+        }
+    }
+    PIN_ReleaseLock(&threadsLock);
 }
 
-LOCALFUN VOID Ul2AccessSingleLine(ADDRINT addr, CACHE_BASE::ACCESS_TYPE accessType)
+LOCALFUN VOID Fini(int code, VOID * v)
 {
-    // second level unified cache
-    //if(CACHE_BASE::)
-    ul2.SpecialAccessSingleLine(addr, accessType);
+    // threads still running at exit have not been through ThreadFini, nor
+    // has the clock counted what they ran of their current slices
+    for (std::vector<THREAD_DATA *>::iterator it = liveThreads.begin(); it != liveThreads.end(); ++it)
+    {
+        clockInstructions += (*it)->granted - (*it)->budget;
+        if ((*it)->phase == PHASE_MEASURE) MergeStats(*it);
+    }
+
+    if (intervalStats.IsOpen())
+    {
+        // the last, partial interval
+        STATS_SNAPSHOT snapshot;
+        snapshot.AddGlobal();
+        intervalStats.Record(clockInstructions, snapshot);
+        intervalStats.Close();
+    }
+
+    //std::cerr << itlb;
+    //std::cerr << dtlb;
+    PrintStats(std::cout);
 
+    if (ul2Profiler != 0)
+    {
+        std::ofstream out(KnobProfileFile.Value().c_str());
+        ul2Profiler->WriteCsv(out);
+    }
+
+    if (traceWriter.IsOpen())
+    {
+        traceWriter.Close();
+        std::cerr << "allcache: recorded " << traceWriter.Events() << " events, "
+                  << traceWriter.Bytes() << " bytes" << std::endl;
+    }
+}
 
+LOCALFUN VOID StoreRefMulti(THREAD_DATA * td, ADDRINT addr, UINT32 size)
+{
+    td->storeAddr = addr;
+    td->storeSize = size;
+    MemRefMulti(td, addr, size, CACHE_BASE::ACCESS_TYPE_STORE);
 }
 
+LOCALFUN VOID AfterStore(THREAD_DATA * td)
+{
+    StoreDone(td, td->storeAddr, td->storeSize);
+}
 
+/*
+ * Same-line fast path: a reference to the line in il1Line/dl1Line is a hit
+ * that changes no cache state (see THREAD_CACHES), so these checks only
+ * count it and are inlined by Pin. InsRef/MemRefSingle run as the "then"
+ * part for everything else.
+ */
 
-LOCALFUN VOID InsRef(ADDRINT addr)
+LOCALFUN ADDRINT PIN_FAST_ANALYSIS_CALL InsLineChanged(THREAD_DATA * td, ADDRINT addr)
 {
-    const UINT32 size = 1; // assuming access does not cross cache lines
-    const CACHE_BASE::ACCESS_TYPE accessType = CACHE_BASE::ACCESS_TYPE_LOAD;
+    const ADDRINT changed = (addr & IL1_LINE_MASK) ^ td->il1Line;
+    td->il1Fast[CACHE_BASE::ACCESS_TYPE_LOAD][true] += (changed == 0);
+    return changed;
+}
 
-    // ITLB
-    //itlb.AccessSingleLine(addr, accessType);
+/// Fetches of a block that stay on the line of the previous instruction
+LOCALFUN VOID PIN_FAST_ANALYSIS_CALL InsSameLine(THREAD_DATA * td, UINT32 count)
+{
+    td->il1Fast[CACHE_BASE::ACCESS_TYPE_LOAD][true] += count;
+}
 
-    // first level I-cache
-    const BOOL il1Hit = il1.AccessSingleLine(addr, accessType);
+LOCALFUN ADDRINT PIN_FAST_ANALYSIS_CALL LoadLineChanged(THREAD_DATA * td, ADDRINT addr)
+{
+    const ADDRINT changed = (addr & DL1_LINE_MASK) ^ td->dl1Line;
+    td->dl1Fast[CACHE_BASE::ACCESS_TYPE_LOAD][true] += (changed == 0);
+    return changed;
+}
 
-    // second level unified Cache
-    if ( ! il1Hit) Ul2Access(addr, size, accessType);
+LOCALFUN ADDRINT PIN_FAST_ANALYSIS_CALL StoreLineChanged(THREAD_DATA * td, ADDRINT addr, UINT32 size)
+{
+    td->storeAddr = addr;
+    td->storeSize = size;
 
+    const ADDRINT changed = (addr & DL1_LINE_MASK) ^ td->dl1Line;
+    td->dl1Fast[CACHE_BASE::ACCESS_TYPE_STORE][true] += (changed == 0);
+    return changed;
 }
 
+/*!
+ *  Record the current contents of every UL2 line covering an access of
+ *  size bytes at addr, i.e. everything the compressor may read for it.
+ *  The reference event must follow.
+ */
+LOCALFUN VOID RecordLines(ADDRINT addr, UINT32 size)
+{
+    const ADDRINT lineSize = traceWriter.LineSize();
+    const ADDRINT notLineMask = ~(lineSize - 1);
+    const ADDRINT highAddr = addr + size;
+    UINT8 data[CACHE_TRACE::MAX_LINE_SIZE];
 
+    traceWriter.BeginReference(addr, size);
+    for (ADDRINT line = addr & notLineMask; line < highAddr; line += lineSize)
+    {
+        const size_t copied = PIN_SafeCopy(data, reinterpret_cast<const VOID *>(line), lineSize);
+        memset(data + copied, 0, lineSize - copied);
+        traceWriter.Line(line, data);
+    }
+}
 
+/*
+ * In record mode the trace lock is held across recording and simulating
+ * a reference, so the order in the trace is the order UL2 saw.
+ */
 
-LOCALFUN VOID MemRefMulti(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+LOCALFUN VOID RecordInsRef(THREAD_DATA * td, ADDRINT addr)
 {
-    // DTLB
-   // dtlb.SpecialAccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+    PIN_GetLock(&traceLock, td->tid + 1);
+    traceWriter.Thread(td->tid);
+    RecordLines(addr, 1);
+    traceWriter.Ins(addr);
+    InsRef(td, addr);
+    PIN_ReleaseLock(&traceLock);
+}
 
-    // first level D-cache
-    const BOOL dl1Hit = dl1.Access(addr, size, accessType);
+LOCALFUN VOID RecordMemRefMulti(THREAD_DATA * td, ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+{
+    PIN_GetLock(&traceLock, td->tid + 1);
+    traceWriter.Thread(td->tid);
+    RecordLines(addr, size);
+    traceWriter.Mem(CACHE_TRACE::EVENT_MEM_MULTI, addr, size, accessType == CACHE_BASE::ACCESS_TYPE_STORE);
+    MemRefMulti(td, addr, size, accessType);
+    PIN_ReleaseLock(&traceLock);
+}
 
-    // second level unified Cache
-    if ( ! dl1Hit) Ul2Access(addr, size, accessType);
+LOCALFUN VOID RecordMemRefSingle(THREAD_DATA * td, ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+{
+    PIN_GetLock(&traceLock, td->tid + 1);
+    traceWriter.Thread(td->tid);
+    RecordLines(addr, size);
+    traceWriter.Mem(CACHE_TRACE::EVENT_MEM_SINGLE, addr, size, accessType == CACHE_BASE::ACCESS_TYPE_STORE);
+    MemRefSingle(td, addr, size, accessType);
+    PIN_ReleaseLock(&traceLock);
 }
 
-LOCALFUN VOID MemRefSingle(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+LOCALFUN VOID RecordStoreRefMulti(THREAD_DATA * td, ADDRINT addr, UINT32 size)
 {
-    // DTLB
-    //dtlb.AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+    td->storeAddr = addr;
+    td->storeSize = size;
+    RecordMemRefMulti(td, addr, size, CACHE_BASE::ACCESS_TYPE_STORE);
+}
 
-    // first level D-cache
-    const BOOL dl1Hit = dl1.AccessSingleLine(addr, accessType);
+LOCALFUN VOID RecordStoreRefSingle(THREAD_DATA * td, ADDRINT addr, UINT32 size)
+{
+    td->storeAddr = addr;
+    td->storeSize = size;
+    RecordMemRefSingle(td, addr, size, CACHE_BASE::ACCESS_TYPE_STORE);
+}
 
-    // second level unified Cache
-    if ( ! dl1Hit) Ul2AccessSingleLine(addr, accessType);
+LOCALFUN VOID RecordAfterStore(THREAD_DATA * td)
+{
+    PIN_GetLock(&traceLock, td->tid + 1);
+    traceWriter.Thread(td->tid);
+    RecordLines(td->storeAddr, td->storeSize);
+    traceWriter.Mem(CACHE_TRACE::EVENT_STORE_DONE, td->storeAddr, td->storeSize, true);
+    AfterStore(td);
+    PIN_ReleaseLock(&traceLock);
 }
 
-LOCALFUN VOID Instruction(INS ins, VOID *v)
+LOCALFUN VOID RecordInstruction(INS ins, VOID *v)
 {
     // all instruction fetches access I-cache
     INS_InsertCall(
-        ins, IPOINT_BEFORE, (AFUNPTR)InsRef,
+        ins, IPOINT_BEFORE, (AFUNPTR)RecordInsRef,
+        IARG_REG_VALUE, threadReg,
         IARG_INST_PTR,
         IARG_END);
 
     if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins))
     {
         const UINT32 size = INS_MemoryReadSize(ins);
-        const AFUNPTR countFun = (size <= 4 ? (AFUNPTR) MemRefSingle : (AFUNPTR) MemRefMulti);
+        const AFUNPTR countFun = (size <= 4 ? (AFUNPTR) RecordMemRefSingle : (AFUNPTR) RecordMemRefMulti);
 
         // only predicated-on memory instructions access D-cache
         INS_InsertPredicatedCall(
             ins, IPOINT_BEFORE, countFun,
+            IARG_REG_VALUE, threadReg,
             IARG_MEMORYREAD_EA,
             IARG_MEMORYREAD_SIZE,
             IARG_UINT32, CACHE_BASE::ACCESS_TYPE_LOAD,
@@ -193,15 +613,171 @@ LOCALFUN VOID Instruction(INS ins, VOID *v)
     if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins))
     {
         const UINT32 size = INS_MemoryWriteSize(ins);
-        const AFUNPTR countFun = (size <= 4 ? (AFUNPTR) MemRefSingle : (AFUNPTR) MemRefMulti);
+        const AFUNPTR countFun = (size <= 4 ? (AFUNPTR) RecordStoreRefSingle : (AFUNPTR) RecordStoreRefMulti);
 
         // only predicated-on memory instructions access D-cache
         INS_InsertPredicatedCall(
             ins, IPOINT_BEFORE, countFun,
+            IARG_REG_VALUE, threadReg,
             IARG_MEMORYWRITE_EA,
             IARG_MEMORYWRITE_SIZE,
-            IARG_UINT32, CACHE_BASE::ACCESS_TYPE_STORE,
             IARG_END);
+
+        // UL2 compresses lines from the stored value
+        if (INS_IsValidForIpointAfter(ins))
+        {
+            INS_InsertPredicatedCall(ins, IPOINT_AFTER, (AFUNPTR)RecordAfterStore, IARG_REG_VALUE, threadReg, IARG_END);
+        }
+        if (INS_IsValidForIpointTakenBranch(ins))
+        {
+            INS_InsertPredicatedCall(ins, IPOINT_TAKEN_BRANCH, (AFUNPTR)RecordAfterStore, IARG_REG_VALUE, threadReg, IARG_END);
+        }
+    }
+}
+
+LOCALFUN VOID MemoryInstruction(INS ins)
+{
+    if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins))
+    {
+        // only predicated-on memory instructions access D-cache
+        if (INS_MemoryReadSize(ins) <= 4)
+        {
+            INS_InsertIfPredicatedCall(
+                ins, IPOINT_BEFORE, (AFUNPTR)LoadLineChanged,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, threadReg,
+                IARG_MEMORYREAD_EA,
+                IARG_END);
+            INS_InsertThenPredicatedCall(
+                ins, IPOINT_BEFORE, (AFUNPTR)MemRefSingle,
+                IARG_REG_VALUE, threadReg,
+                IARG_MEMORYREAD_EA,
+                IARG_MEMORYREAD_SIZE,
+                IARG_UINT32, CACHE_BASE::ACCESS_TYPE_LOAD,
+                IARG_END);
+        }
+        else
+        {
+            INS_InsertPredicatedCall(
+                ins, IPOINT_BEFORE, (AFUNPTR)MemRefMulti,
+                IARG_REG_VALUE, threadReg,
+                IARG_MEMORYREAD_EA,
+                IARG_MEMORYREAD_SIZE,
+                IARG_UINT32, CACHE_BASE::ACCESS_TYPE_LOAD,
+                IARG_END);
+        }
+    }
+
+    if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins))
+    {
+        // only predicated-on memory instructions access D-cache
+        if (INS_MemoryWriteSize(ins) <= 4)
+        {
+            INS_InsertIfPredicatedCall(
+                ins, IPOINT_BEFORE, (AFUNPTR)StoreLineChanged,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, threadReg,
+                IARG_MEMORYWRITE_EA,
+                IARG_MEMORYWRITE_SIZE,
+                IARG_END);
+            INS_InsertThenPredicatedCall(
+                ins, IPOINT_BEFORE, (AFUNPTR)MemRefSingle,
+                IARG_REG_VALUE, threadReg,
+                IARG_MEMORYWRITE_EA,
+                IARG_MEMORYWRITE_SIZE,
+                IARG_UINT32, CACHE_BASE::ACCESS_TYPE_STORE,
+                IARG_END);
+        }
+        else
+        {
+            INS_InsertPredicatedCall(
+                ins, IPOINT_BEFORE, (AFUNPTR)StoreRefMulti,
+                IARG_REG_VALUE, threadReg,
+                IARG_MEMORYWRITE_EA,
+                IARG_MEMORYWRITE_SIZE,
+                IARG_END);
+        }
+
+        // UL2 compresses lines from the stored value
+        if (INS_IsValidForIpointAfter(ins))
+        {
+            INS_InsertPredicatedCall(ins, IPOINT_AFTER, (AFUNPTR)AfterStore, IARG_REG_VALUE, threadReg, IARG_END);
+        }
+        if (INS_IsValidForIpointTakenBranch(ins))
+        {
+            INS_InsertPredicatedCall(ins, IPOINT_TAKEN_BRANCH, (AFUNPTR)AfterStore, IARG_REG_VALUE, threadReg, IARG_END);
+        }
+    }
+}
+
+LOCALFUN VOID Trace(TRACE trace, VOID *v)
+{
+    const BOOL simulate = (phase != PHASE_FFWD);
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        const INS head = BBL_InsHead(bbl);
+
+        if (clocked)
+        {
+            INS_InsertIfCall(
+                head, IPOINT_BEFORE, (AFUNPTR)CountDown,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, threadReg,
+                IARG_UINT32, BBL_NumIns(bbl),
+                IARG_END);
+            INS_InsertThenCall(
+                head, IPOINT_BEFORE, (AFUNPTR)ClockTick,
+                IARG_REG_VALUE, threadReg,
+                IARG_UINT32, BBL_NumIns(bbl),
+                IARG_CONTEXT,
+                IARG_END);
+        }
+
+        if (!simulate) continue;
+
+        // an instruction on the same I-cache line as its predecessor in the
+        // block always hits, only the others need a dynamic check
+        UINT32 sameLine = 0;
+        ADDRINT lastLine = THREAD_CACHES::NO_LINE;
+
+        for (INS ins = head; INS_Valid(ins); ins = INS_Next(ins))
+        {
+            const ADDRINT line = INS_Address(ins) & IL1_LINE_MASK;
+
+            // all instruction fetches access I-cache
+            if (line == lastLine)
+            {
+                sameLine++;
+            }
+            else
+            {
+                INS_InsertIfCall(
+                    ins, IPOINT_BEFORE, (AFUNPTR)InsLineChanged,
+                    IARG_FAST_ANALYSIS_CALL,
+                    IARG_REG_VALUE, threadReg,
+                    IARG_INST_PTR,
+                    IARG_END);
+                INS_InsertThenCall(
+                    ins, IPOINT_BEFORE, (AFUNPTR)InsRef,
+                    IARG_REG_VALUE, threadReg,
+                    IARG_INST_PTR,
+                    IARG_END);
+            }
+            lastLine = line;
+
+            MemoryInstruction(ins);
+        }
+
+        if (sameLine != 0)
+        {
+            INS_InsertCall(
+                head, IPOINT_BEFORE, (AFUNPTR)InsSameLine,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, threadReg,
+                IARG_UINT32, sameLine,
+                IARG_END);
+        }
     }
 }
 
@@ -209,7 +785,107 @@ GLOBALFUN int main(int argc, char *argv[])
 {
     PIN_Init(argc, argv);
 
-    INS_AddInstrumentFunction(Instruction, 0);
+    if (!CheckUl2Tags(std::cerr, "allcache")) return 1;
+
+    const UINT32 stripes = KnobL2Stripes.Value();
+    if (stripes == 0 || !IsPower2(stripes) || stripes > ul2.SetCount())
+    {
+        std::cerr << "allcache: -l2_stripes must be a power of 2 between 1 and " << ul2.SetCount() << std::endl;
+        return 1;
+    }
+
+    sampling = KnobFastForward.Value() != 0 || KnobWarmup.Value() != 0 || KnobMeasure.Value() != 0;
+    if (sampling)
+    {
+        phase = PHASE_FFWD;
+        if (PhaseLength(phase) == 0) phase = FollowingPhase(phase);
+    }
+
+    if (!KnobRestoreFile.Value().empty())
+    {
+        // the mapping stays for the threads to restore their L1s from
+        const int fd = open(KnobRestoreFile.Value().c_str(), O_RDONLY);
+        struct stat st;
+        VOID *data = MAP_FAILED;
+        if (fd >= 0 && fstat(fd, &st) == 0) data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0) close(fd);
+
+        if (data == MAP_FAILED || !restoreReader.Open(data, st.st_size) || !RestoreCheckpoint(restoreReader))
+        {
+            std::cerr << "allcache: " << KnobRestoreFile.Value() << " is not a checkpoint of these caches" << std::endl;
+            return 1;
+        }
+        restoreSkip = restoreReader.Instructions();
+        restoring = restoreSkip != 0;
+        if (restoring) phase = PHASE_FFWD;
+    }
+
+    if (!KnobStatsFile.Value().empty())
+    {
+        if (KnobStatsInterval.Value() == 0 || !intervalStats.Open(KnobStatsFile.Value()))
+        {
+            std::cerr << "allcache: cannot write statistics to " << KnobStatsFile.Value() << std::endl;
+            return 1;
+        }
+        // records continue from the checkpoint
+        const UINT64 interval = KnobStatsInterval.Value();
+        nextInterval = (restoreSkip / interval + 1) * interval;
+        STATS_SNAPSHOT snapshot;
+        snapshot.AddGlobal();
+        intervalStats.Start(restoreSkip, snapshot);
+    }
+
+    if (!KnobCheckpointFile.Value().empty())
+    {
+        if (KnobCheckpointAt.Value() != 0 && KnobCheckpointAt.Value() <= restoreSkip)
+        {
+            std::cerr << "allcache: -checkpoint_at must be after the instructions of -restore" << std::endl;
+            return 1;
+        }
+        if (KnobCheckpointAt.Value() != 0) nextCheckpoint = KnobCheckpointAt.Value();
+        PIN_InterceptSignal(SIGUSR1, CheckpointSignal, 0);
+        PIN_UnblockSignal(SIGUSR1, true);
+    }
+    clocked = sampling || intervalStats.IsOpen() || restoring || !KnobCheckpointFile.Value().empty();
+
+    if (!KnobRecordFile.Value().empty())
+    {
+        if (clocked)
+        {
+            std::cerr << "allcache: -record cannot be combined with sampling, -stats or checkpoints" << std::endl;
+            return 1;
+        }
+        if (!traceWriter.Open(KnobRecordFile.Value(), UL2::lineSize))
+        {
+            std::cerr << "allcache: cannot open trace file " << KnobRecordFile.Value() << std::endl;
+            return 1;
+        }
+    }
+
+    threadReg = PIN_ClaimToolRegister();
+    if (!REG_valid(threadReg))
+    {
+        std::cerr << "allcache: cannot allocate a scratch register" << std::endl;
+        return 1;
+    }
+    threadKey = PIN_CreateThreadDataKey(0);
+    PIN_InitLock(&threadsLock);
+    PIN_InitLock(&traceLock);
+    PIN_InitLock(&clockLock);
+    ul2.EnableSharing(stripes);
+
+    if (!KnobProfileFile.Value().empty())
+    {
+        ul2Profiler = new CACHE_PROFILE::STACK_PROFILER(UL2::lineSize,
+            KnobProfileMinSets.Value(), KnobProfileMaxSets.Value(), KnobProfileMaxAssoc.Value());
+        ul2Profiler->EnableSharing(stripes);
+    }
+
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+    // the trace records every reference, so it keeps the plain per-instruction calls
+    if (traceWriter.IsOpen()) INS_AddInstrumentFunction(RecordInstruction, 0);
+    else TRACE_AddInstrumentFunction(Trace, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
@@ -0,0 +1,403 @@
+/*! @file
+ *  Offline driver for the allcache cache hierarchy. Replays a trace written
+ *  by "allcache -record <file>" through the same IL1/DL1/UL2 objects the Pin
+ *  tool uses, without needing Pin.
+ *
+ *  Build: g++ -O2 -std=c++11 -o allcache_replay allcache_replay.cpp
+ *  Usage: allcache_replay [-profile <csv> [-profile_min_sets <n>]
+ *                          [-profile_max_sets <n>] [-profile_max_assoc <n>]]
+ *                         [-stats <csv> [-stats_interval <n>]]
+ *                         [-checkpoint <file> -checkpoint_at <n>]
+ *                         [-restore <file>] <trace>
+ *
+ *  The options match the ones of the Pin tool. With -restore, the caches
+ *  start from the checkpoint and the references of the instructions it had
+ *  already seen are skipped.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pin_shim.H"
+
+#include "allcache.H"
+#include "allcache_trace.H"
+
+/*!
+ *  @brief Target memory as far as the trace has shown it
+ *
+ *  Holds the latest LINE event for every line address; bytes of lines the
+ *  trace never described read as zero. Line contents live in one pool,
+ *  found through an open-addressed index from line number to pool entry,
+ *  so an event costs a probe and a copy rather than an allocation.
+ */
+class LINE_IMAGE
+{
+  private:
+    static const ADDRINT EMPTY = ~ADDRINT(0);
+
+    std::vector<UINT8> _pool;       // _lineSize bytes per known line
+    std::vector<ADDRINT> _keys;     // line number, or EMPTY
+    std::vector<UINT32> _entries;   // pool entry of the line in _keys
+    UINT32 _lineSize;
+    UINT32 _lineShift;
+    UINT32 _lines;
+
+    static size_t Hash(ADDRINT line) { return size_t((UINT64(line) * 0x9e3779b97f4a7c15ULL) >> 20); }
+
+    /// @returns index slot of line, or of the empty slot it would take
+    size_t Probe(ADDRINT line) const
+    {
+        const size_t mask = _keys.size() - 1;
+        size_t slot = Hash(line) & mask;
+        while (_keys[slot] != line && _keys[slot] != EMPTY) slot = (slot + 1) & mask;
+        return slot;
+    }
+
+    VOID Grow()
+    {
+        std::vector<ADDRINT> keys(_keys.size() * 2, EMPTY);
+        std::vector<UINT32> entries(keys.size());
+        _keys.swap(keys);
+        _entries.swap(entries);
+
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (keys[i] == EMPTY) continue;
+            const size_t slot = Probe(keys[i]);
+            _keys[slot] = keys[i];
+            _entries[slot] = entries[i];
+        }
+    }
+
+  public:
+    LINE_IMAGE() : _keys(64 * KILO, EMPTY), _entries(64 * KILO), _lineSize(0), _lineShift(0), _lines(0) {}
+
+    VOID SetLineSize(UINT32 lineSize)
+    {
+        _lineSize = lineSize;
+        _lineShift = FloorLog2(lineSize);
+    }
+
+    VOID Update(ADDRINT lineAddr, const UINT8 *data)
+    {
+        const ADDRINT line = lineAddr >> _lineShift;
+        size_t slot = Probe(line);
+
+        if (_keys[slot] == EMPTY)
+        {
+            // keep the index at most half full
+            if (2 * (_lines + 1) > _keys.size())
+            {
+                Grow();
+                slot = Probe(line);
+            }
+            _keys[slot] = line;
+            _entries[slot] = _lines++;
+            _pool.resize(size_t(_lines) * _lineSize);
+        }
+        memcpy(&_pool[size_t(_entries[slot]) * _lineSize], data, _lineSize);
+    }
+
+    VOID Read(ADDRINT addr, VOID *buf, UINT32 size) const
+    {
+        UINT8 *out = static_cast<UINT8 *>(buf);
+        const ADDRINT notLineMask = ~ADDRINT(_lineSize - 1);
+
+        while (size > 0)
+        {
+            const ADDRINT lineAddr = addr & notLineMask;
+            const UINT32 offset = UINT32(addr - lineAddr);
+            const UINT32 chunk = std::min(size, _lineSize - offset);
+            const size_t slot = Probe(lineAddr >> _lineShift);
+
+            if (_keys[slot] == EMPTY) memset(out, 0, chunk);
+            else memcpy(out, &_pool[size_t(_entries[slot]) * _lineSize + offset], chunk);
+
+            out += chunk;
+            addr += chunk;
+            size -= chunk;
+        }
+    }
+};
+
+const ADDRINT LINE_IMAGE::EMPTY;
+
+LOCALVAR LINE_IMAGE image;
+
+LOCALFUN VOID ReadImage(ADDRINT addr, VOID *buf, UINT32 size)
+{
+    image.Read(addr, buf, size);
+}
+
+/*!
+ *  @brief Feeds decoded trace events into the hierarchy
+ */
+class HIERARCHY_SINK
+{
+  private:
+    std::map<UINT32, THREAD_CACHES *> _threads;
+    THREAD_CACHES * _tc;
+
+    INTERVAL_STATS * _stats;
+    UINT64 _interval;
+    UINT64 _instructions;
+
+    const CACHE_CHECKPOINT::READER * _restore;
+    UINT64 _skip;               // instructions already in the restored caches
+    std::string _checkpoint;
+    UINT64 _checkpointAt;
+
+    STATS_SNAPSHOT Snapshot() const
+    {
+        STATS_SNAPSHOT snapshot;
+        snapshot.AddGlobal();
+        for (std::map<UINT32, THREAD_CACHES *>::const_iterator it = _threads.begin(); it != _threads.end(); ++it)
+        {
+            snapshot.Add(it->second);
+        }
+        return snapshot;
+    }
+
+  public:
+    /// Write a record to stats every interval instruction fetches, if stats is set
+    HIERARCHY_SINK(INTERVAL_STATS * stats, UINT64 interval)
+      : _tc(0), _stats(stats), _interval(interval), _instructions(0),
+        _restore(0), _skip(0), _checkpointAt(0)
+    {}
+
+    /// Continue from the checkpoint in reader, whose global state is restored already
+    VOID Restore(const CACHE_CHECKPOINT::READER * reader)
+    {
+        _restore = reader;
+        _skip = reader->Instructions();
+        if (_stats != 0) _stats->Start(_skip, Snapshot());
+    }
+
+    /// Write a checkpoint to name after instructions instruction fetches
+    VOID CheckpointAt(const std::string & name, UINT64 instructions)
+    {
+        _checkpoint = name;
+        _checkpointAt = instructions;
+    }
+
+    /// @returns false if a checkpoint was due and could not be written
+    bool SaveCheckpoint()
+    {
+        CHECKPOINT_THREADS threads;
+        for (std::map<UINT32, THREAD_CACHES *>::const_iterator it = _threads.begin(); it != _threads.end(); ++it)
+        {
+            threads.push_back(std::make_pair(it->first, it->second));
+        }
+        const bool ok = ::SaveCheckpoint(_checkpoint, _instructions, Snapshot(), threads);
+        _checkpoint.clear();
+        return ok;
+    }
+
+    bool CheckpointPending() const { return !_checkpoint.empty(); }
+
+    ~HIERARCHY_SINK()
+    {
+        for (std::map<UINT32, THREAD_CACHES *>::iterator it = _threads.begin(); it != _threads.end(); ++it)
+        {
+            delete it->second;
+        }
+    }
+
+    /// Record the last, partial interval
+    VOID FinishStats()
+    {
+        if (_stats != 0) _stats->Record(_instructions, Snapshot());
+    }
+
+    /// Fold all threads' statistics into the global totals
+    VOID MergeAll()
+    {
+        for (std::map<UINT32, THREAD_CACHES *>::iterator it = _threads.begin(); it != _threads.end(); ++it)
+        {
+            MergeStats(it->second);
+        }
+    }
+
+    VOID Thread(UINT32 thread)
+    {
+        THREAD_CACHES *& tc = _threads[thread];
+        if (tc == 0)
+        {
+            tc = new THREAD_CACHES;
+            if (_restore != 0) RestoreThread(*_restore, thread, tc);
+        }
+        _tc = tc;
+    }
+
+    VOID Ins(ADDRINT addr)
+    {
+        // the restored caches have seen this instruction, but not yet its data references
+        if (_instructions < _skip)
+        {
+            _instructions++;
+            return;
+        }
+
+        InsRef(_tc, addr);
+        if (++_instructions % _interval == 0 && _stats != 0) _stats->Record(_instructions, Snapshot());
+        if (_instructions == _checkpointAt && CheckpointPending() && !SaveCheckpoint())
+        {
+            std::cerr << "allcache_replay: cannot write checkpoint" << std::endl;
+        }
+    }
+
+    VOID Mem(CACHE_TRACE::EVENT_KIND kind, ADDRINT addr, UINT32 size, bool store)
+    {
+        if (_instructions < _skip) return;
+
+        const CACHE_BASE::ACCESS_TYPE accessType =
+            store ? CACHE_BASE::ACCESS_TYPE_STORE : CACHE_BASE::ACCESS_TYPE_LOAD;
+
+        if (kind == CACHE_TRACE::EVENT_MEM_SINGLE) MemRefSingle(_tc, addr, size, accessType);
+        else if (kind == CACHE_TRACE::EVENT_MEM_MULTI) MemRefMulti(_tc, addr, size, accessType);
+        else StoreDone(_tc, addr, size);
+    }
+
+    VOID Line(ADDRINT lineAddr, const UINT8 *data) { image.Update(lineAddr, data); }
+};
+
+GLOBALFUN int main(int argc, char *argv[])
+{
+    std::string profileFile;
+    UINT32 profileMinSets = 1024;
+    UINT32 profileMaxSets = 16384;
+    UINT32 profileMaxAssoc = 16;
+    std::string statsFile;
+    UINT64 statsInterval = 10000000;
+    std::string checkpointFile;
+    UINT64 checkpointAt = 0;
+    std::string restoreFile;
+
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        const std::string option = argv[arg];
+        if (option == "-profile") profileFile = argv[arg + 1];
+        else if (option == "-profile_min_sets") profileMinSets = atoi(argv[arg + 1]);
+        else if (option == "-profile_max_sets") profileMaxSets = atoi(argv[arg + 1]);
+        else if (option == "-profile_max_assoc") profileMaxAssoc = atoi(argv[arg + 1]);
+        else if (option == "-stats") statsFile = argv[arg + 1];
+        else if (option == "-stats_interval") statsInterval = strtoull(argv[arg + 1], 0, 10);
+        else if (option == "-checkpoint") checkpointFile = argv[arg + 1];
+        else if (option == "-checkpoint_at") checkpointAt = strtoull(argv[arg + 1], 0, 10);
+        else if (option == "-restore") restoreFile = argv[arg + 1];
+        else break;
+    }
+    if (arg + 1 != argc || statsInterval == 0 || checkpointFile.empty() != (checkpointAt == 0))
+    {
+        std::cerr << "usage: " << argv[0] << " [-profile <csv> [-profile_min_sets <n>]"
+                  << " [-profile_max_sets <n>] [-profile_max_assoc <n>]]"
+                  << " [-stats <csv> [-stats_interval <n>]]"
+                  << " [-checkpoint <file> -checkpoint_at <n>] [-restore <file>] <trace>" << std::endl;
+        return 1;
+    }
+    const char *traceFile = argv[arg];
+
+    const int fd = open(traceFile, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        std::cerr << "allcache_replay: cannot open " << traceFile << std::endl;
+        return 1;
+    }
+
+    VOID *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "allcache_replay: cannot map " << traceFile << std::endl;
+        return 1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    CACHE_TRACE::READER reader;
+    if (!reader.Open(data, st.st_size))
+    {
+        std::cerr << "allcache_replay: " << traceFile << " is not an allcache trace" << std::endl;
+        return 1;
+    }
+
+    image.SetLineSize(reader.LineSize());
+    CacheDataReader = ReadImage;
+    if (!CheckUl2Tags(std::cerr, "allcache_replay")) return 1;
+
+    if (!profileFile.empty())
+    {
+        ul2Profiler = new CACHE_PROFILE::STACK_PROFILER(UL2::lineSize,
+            profileMinSets, profileMaxSets, profileMaxAssoc);
+    }
+
+    INTERVAL_STATS stats;
+    if (!statsFile.empty() && !stats.Open(statsFile))
+    {
+        std::cerr << "allcache_replay: cannot write statistics to " << statsFile << std::endl;
+        return 1;
+    }
+
+    HIERARCHY_SINK sink(stats.IsOpen() ? &stats : 0, statsInterval);
+
+    VOID *checkpointData = MAP_FAILED;
+    size_t checkpointSize = 0;
+    CACHE_CHECKPOINT::READER checkpoint;
+    if (!restoreFile.empty())
+    {
+        const int cfd = open(restoreFile.c_str(), O_RDONLY);
+        struct stat cst;
+        if (cfd >= 0 && fstat(cfd, &cst) == 0)
+        {
+            checkpointSize = cst.st_size;
+            checkpointData = mmap(0, checkpointSize, PROT_READ, MAP_PRIVATE, cfd, 0);
+        }
+        if (cfd >= 0) close(cfd);
+
+        if (checkpointData == MAP_FAILED || !checkpoint.Open(checkpointData, checkpointSize) ||
+            !RestoreCheckpoint(checkpoint))
+        {
+            std::cerr << "allcache_replay: " << restoreFile << " is not a checkpoint of these caches" << std::endl;
+            return 1;
+        }
+        sink.Restore(&checkpoint);
+    }
+    if (!checkpointFile.empty()) sink.CheckpointAt(checkpointFile, checkpointAt);
+
+    const UINT64 events = reader.Replay(sink);
+    if (reader.Damaged())
+    {
+        std::cerr << "allcache_replay: " << traceFile << " is truncated or corrupt, replayed up to the damage" << std::endl;
+    }
+    if (sink.CheckpointPending())
+    {
+        std::cerr << "allcache_replay: the trace ends before instruction " << checkpointAt
+                  << ", no checkpoint written" << std::endl;
+    }
+    sink.FinishStats();
+    stats.Close();
+    sink.MergeAll();
+
+    PrintStats(std::cout);
+    if (ul2Profiler != 0)
+    {
+        std::ofstream out(profileFile.c_str());
+        ul2Profiler->WriteCsv(out);
+    }
+    std::cerr << "allcache_replay: replayed " << events << " events" << std::endl;
+
+    if (checkpointData != MAP_FAILED) munmap(checkpointData, checkpointSize);
+    munmap(data, st.st_size);
+    return 0;
+}
@@ -0,0 +1,1126 @@
+/*! @file
+ *  Microbenchmark and regression check for the cache sets of pin_cache.H,
+ *  without Pin.
+ *
+ *  Build: g++ -O2 -std=c++11 -o pin_cache_bench pin_cache_bench.cpp
+ *  Usage: pin_cache_bench [-check] [-accesses <n>] [-footprint_kb <n>]
+ *                         [-compressible <fraction>] [-stores <fraction>]
+ *                         [-size <bytes>] [-stride <bytes>] [-zipf <theta>]
+ *                         [-seed <n>]
+ *
+ *  Drives a round robin cache with the DL1 geometry through AccessSingleLine
+ *  and Access, and compressed caches with the UL2 geometry through
+ *  SpecialAccessSingleLine and SpecialAccess (plus SpecialUpdate after
+ *  stores), with sequential, strided, random and Zipfian reference streams
+ *  over a synthetic memory. -compressible is the fraction of lines and
+ *  stored values that compress well. For every run it prints accesses per
+ *  second and ns per access.
+ *
+ *  With -check it instead replays every stream through the round robin and
+ *  the LRU compressed cache and through naive reference models of both,
+ *  the LRU one with its own word by word FPC, and fails unless hits,
+ *  misses, evictions and the UL2 contents agree. It also checks the SSE2
+ *  line compression against the scalar code, and the round robin, LRU,
+ *  tree PLRU and RRIP caches against fixed counts on streams of a fixed
+ *  seed, and that every chunk of a trace written by allcache_trace.H
+ *  replays on its own. Run it before and after changing the set logic.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+#include "pin_shim.H"
+
+typedef UINT64 CACHE_STATS;
+
+#include "pin_cache.H"
+#include "allcache_trace.H"
+
+namespace RR
+{
+    // as DL1 in allcache.H: 32 kB, 32 B lines, 32-way associative
+    const UINT32 cacheSize = 32*KILO;
+    const UINT32 lineSize = 32;
+    const UINT32 associativity = 32;
+    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_NO_ALLOCATE;
+
+    const UINT32 max_sets = cacheSize / (lineSize * associativity);
+
+    typedef CACHE_ROUND_ROBIN(max_sets, associativity, allocation) CACHE;
+}
+
+namespace COMPRESSED
+{
+    // as UL2 in allcache.H: 2 MB, 64 B lines, 4 way compressed
+    const UINT32 cacheSize = 2*MEGA;
+    const UINT32 lineSize = 64;
+    const UINT32 associativity = 4;
+    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+
+    const UINT32 max_sets = cacheSize / (lineSize * associativity);
+
+    typedef CACHE_LRU(max_sets, associativity, lineSize, allocation) LRU_CACHE;
+    typedef CACHE_PLRU(max_sets, associativity, lineSize, allocation) PLRU_CACHE;
+    typedef CACHE_RRIP(max_sets, associativity, lineSize, allocation) RRIP_CACHE;
+}
+
+/*!
+ *  Uniform in [0, 1). Unlike std::uniform_real_distribution this is the
+ *  same with every standard library, so streams and the golden counts of
+ *  -check only depend on the seed.
+ */
+LOCALFUN FLT64 Uniform(std::mt19937_64 & rng)
+{
+    return FLT64(rng() >> 11) * (1.0 / FLT64(UINT64(1) << 53));
+}
+
+/*!
+ *  @brief Synthetic target memory, read by the compressed caches
+ *
+ *  Starts at BASE so that no line has tag 0, which empty round robin sets
+ *  would report as present.
+ */
+class MEMORY
+{
+  public:
+    static const ADDRINT BASE = ADDRINT(1) << 28;
+
+  private:
+    std::vector<UINT8> _bytes;
+
+  public:
+    /// Fill size bytes; a compressible fraction of the lines hold small values
+    VOID Fill(size_t size, FLT64 compressible, UINT64 seed)
+    {
+        std::mt19937_64 rng(seed);
+
+        _bytes.resize(size);
+        for (size_t line = 0; line < size; line += COMPRESSED::lineSize)
+        {
+            const bool compress = Uniform(rng) < compressible;
+            for (size_t word = line; word < line + COMPRESSED::lineSize; word += sizeof(UINT32))
+            {
+                Write(BASE + word, Value(rng, compress), sizeof(UINT32));
+            }
+        }
+    }
+
+    /// A value to store: zero or a small integer if compress, else random
+    static UINT32 Value(std::mt19937_64 & rng, bool compress)
+    {
+        const UINT64 r = rng();
+        if (!compress) return UINT32(r);
+        return (r & 1) ? 0 : UINT32(INT32(int8_t(r >> 8)));
+    }
+
+    VOID Write(ADDRINT addr, UINT32 value, UINT32 size)
+    {
+        for (UINT32 i = 0; i < size; i++)
+        {
+            _bytes[(addr - BASE + i) % _bytes.size()] = UINT8(value >> (8 * (i % sizeof(value))));
+        }
+    }
+
+    VOID Read(ADDRINT addr, VOID *buf, UINT32 size) const
+    {
+        UINT8 *out = static_cast<UINT8 *>(buf);
+        const size_t offset = (addr - BASE) % _bytes.size();
+
+        if (offset + size <= _bytes.size())
+        {
+            memcpy(out, &_bytes[offset], size);
+            return;
+        }
+        for (UINT32 i = 0; i < size; i++)
+        {
+            out[i] = _bytes[(offset + i) % _bytes.size()];
+        }
+    }
+};
+
+LOCALVAR MEMORY memory;
+
+LOCALFUN VOID ReadMemory(ADDRINT addr, VOID *buf, UINT32 size)
+{
+    memory.Read(addr, buf, size);
+}
+
+struct REF
+{
+    ADDRINT addr;   // 4 byte aligned
+    UINT32 value;   // stored value
+    bool store;
+};
+
+struct STREAM
+{
+    std::string name;
+    std::vector<REF> refs;
+};
+
+struct OPTIONS
+{
+    bool check;
+    UINT64 accesses;
+    UINT64 footprint;
+    FLT64 compressible;
+    FLT64 stores;
+    UINT32 size;
+    UINT64 stride;
+    FLT64 zipf;
+    UINT64 seed;
+};
+
+/// A reference at offset into the footprint
+LOCALFUN REF MakeRef(const OPTIONS & options, std::mt19937_64 & rng, UINT64 offset)
+{
+    REF ref;
+    ref.addr = MEMORY::BASE + (offset % options.footprint & ~UINT64(3));
+    ref.store = Uniform(rng) < options.stores;
+    ref.value = MEMORY::Value(rng, Uniform(rng) < options.compressible);
+    return ref;
+}
+
+LOCALFUN std::vector<STREAM> MakeStreams(const OPTIONS & options)
+{
+    std::vector<STREAM> streams(4);
+    std::mt19937_64 rng(options.seed);
+
+    streams[0].name = "sequential";
+    for (UINT64 i = 0; i < options.accesses; i++)
+    {
+        streams[0].refs.push_back(MakeRef(options, rng, i * 4));
+    }
+
+    streams[1].name = "strided";
+    for (UINT64 i = 0; i < options.accesses; i++)
+    {
+        streams[1].refs.push_back(MakeRef(options, rng, i * options.stride));
+    }
+
+    streams[2].name = "random";
+    for (UINT64 i = 0; i < options.accesses; i++)
+    {
+        streams[2].refs.push_back(MakeRef(options, rng, rng()));
+    }
+
+    // Zipfian over the lines, hot lines scattered by an odd multiplier
+    streams[3].name = "zipf";
+    const UINT64 lines = options.footprint / COMPRESSED::lineSize;
+    std::vector<FLT64> cdf(lines);
+    FLT64 sum = 0;
+    for (UINT64 rank = 0; rank < lines; rank++)
+    {
+        sum += 1.0 / std::pow(FLT64(rank + 1), options.zipf);
+        cdf[rank] = sum;
+    }
+    for (UINT64 i = 0; i < options.accesses; i++)
+    {
+        const UINT64 rank = std::lower_bound(cdf.begin(), cdf.end(), Uniform(rng) * sum) - cdf.begin();
+        const UINT64 line = (std::min(rank, lines - 1) * 0x9e3779b1ULL) & (lines - 1);
+        streams[3].refs.push_back(MakeRef(options, rng, line * COMPRESSED::lineSize + (rng() % COMPRESSED::lineSize)));
+    }
+
+    return streams;
+}
+
+/*
+ * Drivers. Single line methods reference 4 bytes, which never cross a
+ * line; the others reference -size bytes at the same addresses. After a
+ * store the compressed caches see the new value through SpecialUpdate, as
+ * in allcache.H.
+ */
+
+template <class CACHE_TYPE>
+LOCALFUN VOID DriveAccess(CACHE_TYPE & cache, const STREAM & stream, bool singleLine, UINT32 size)
+{
+    const std::vector<REF> & refs = stream.refs;
+
+    if (singleLine)
+    {
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            cache.AccessSingleLine(refs[i].addr, refs[i].store ? CACHE_BASE::ACCESS_TYPE_STORE : CACHE_BASE::ACCESS_TYPE_LOAD);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            cache.Access(refs[i].addr, size, refs[i].store ? CACHE_BASE::ACCESS_TYPE_STORE : CACHE_BASE::ACCESS_TYPE_LOAD);
+        }
+    }
+}
+
+template <class CACHE_TYPE>
+LOCALFUN VOID DriveSpecial(CACHE_TYPE & cache, const STREAM & stream, bool singleLine, UINT32 size)
+{
+    const std::vector<REF> & refs = stream.refs;
+
+    if (singleLine)
+    {
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            if (!refs[i].store)
+            {
+                cache.SpecialAccessSingleLine(refs[i].addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+                continue;
+            }
+            cache.SpecialAccessSingleLine(refs[i].addr, CACHE_BASE::ACCESS_TYPE_STORE);
+            memory.Write(refs[i].addr, refs[i].value, sizeof(UINT32));
+            cache.SpecialUpdate(refs[i].addr, sizeof(UINT32));
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            if (!refs[i].store)
+            {
+                cache.SpecialAccess(refs[i].addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
+                continue;
+            }
+            cache.SpecialAccess(refs[i].addr, size, CACHE_BASE::ACCESS_TYPE_STORE);
+            memory.Write(refs[i].addr, refs[i].value, size);
+            cache.SpecialUpdate(refs[i].addr, size);
+        }
+    }
+}
+
+/*!
+ *  @brief Round robin sets kept the plain way, for -check
+ */
+class REFERENCE_ROUND_ROBIN
+{
+  private:
+    std::vector<ADDRINT> _tags;     // [set][way]
+    std::vector<UINT32> _next;      // way to replace next, counting down
+
+  public:
+    UINT64 hits;
+    UINT64 misses;
+
+    REFERENCE_ROUND_ROBIN()
+      : _tags(RR::max_sets * RR::associativity, 0),
+        _next(RR::max_sets, RR::associativity - 1),
+        hits(0), misses(0)
+    {}
+
+    bool Access(ADDRINT addr, UINT32 size, bool store)
+    {
+        bool allHit = true;
+        for (ADDRINT line = addr / RR::lineSize; line <= (addr + size - 1) / RR::lineSize; line++)
+        {
+            const UINT32 set = UINT32(line % RR::max_sets);
+            ADDRINT *ways = &_tags[set * RR::associativity];
+
+            const bool hit = std::find(ways, ways + RR::associativity, line) != ways + RR::associativity;
+            if (!hit && (!store || RR::allocation == CACHE_ALLOC::STORE_ALLOCATE))
+            {
+                ways[_next[set]] = line;
+                _next[set] = (_next[set] + RR::associativity - 1) % RR::associativity;
+            }
+            allHit = allHit && hit;
+        }
+        (allHit ? hits : misses)++;
+        return allHit;
+    }
+};
+
+/*!
+ *  FPC size of a line in segments the plain way, word by word after the
+ *  table in pin_cache.H, so that -check does not test CACHE_COMPRESS
+ *  against itself.
+ */
+LOCALFUN UINT32 NaiveSegments(const UINT8 *line, UINT32 size)
+{
+    UINT32 bits = 0;
+    UINT32 zeroRun = 0;
+
+    for (UINT32 i = 0; i < size; i += 4)
+    {
+        const UINT8 *b = line + i;
+        const UINT32 word = b[0] | b[1] << 8 | b[2] << 16 | UINT32(b[3]) << 24;
+        const INT32 value = INT32(word);
+        const int16_t lowHalf = int16_t(b[0] | b[1] << 8);
+        const int16_t highHalf = int16_t(b[2] | b[3] << 8);
+
+        if (word == 0)
+        {
+            // a new zero run, or the 9th word of one
+            if (zeroRun++ % CACHE_COMPRESS::ZERO_RUN_MAX == 0) bits += 3 + 3;
+            continue;
+        }
+        zeroRun = 0;
+
+        if (value >= -8 && value <= 7) bits += 3 + 4;
+        else if (value >= -128 && value <= 127) bits += 3 + 8;
+        else if (b[0] == b[1] && b[1] == b[2] && b[2] == b[3]) bits += 3 + 8;
+        else if (value >= -32768 && value <= 32767) bits += 3 + 16;
+        else if (lowHalf == 0) bits += 3 + 16;
+        else if (lowHalf >= -128 && lowHalf <= 127 && highHalf >= -128 && highHalf <= 127) bits += 3 + 16;
+        else bits += 3 + 32;
+    }
+
+    const UINT32 segments = (bits + 63) / 64;
+    return std::min(segments, size / 8);
+}
+
+/*!
+ *  @brief Compressed sets with true LRU kept as lists, for -check
+ *
+ *  A set has associativity * lineSize/8 segments and 8 * associativity
+ *  tags. A line takes the segments NaiveSegments() compresses it to.
+ */
+class REFERENCE_COMPRESSED
+{
+  private:
+    static const UINT32 SEGMENTS = COMPRESSED::associativity * COMPRESSED::lineSize / CACHE_COMPRESS::SEGMENT_SIZE;
+    static const UINT32 TAGS = 8 * COMPRESSED::associativity;
+
+    struct LINE
+    {
+        ADDRINT tag;
+        UINT32 segments;
+    };
+
+    std::vector<std::list<LINE> > _sets;    // most recently used first
+    std::vector<UINT32> _free;              // segments
+
+    static UINT32 Segments(ADDRINT line)
+    {
+        UINT8 data[COMPRESSED::lineSize];
+        memory.Read(line * COMPRESSED::lineSize, data, sizeof(data));
+        return NaiveSegments(data, sizeof(data));
+    }
+
+    std::list<LINE>::iterator Find(UINT32 set, ADDRINT line)
+    {
+        std::list<LINE>::iterator it = _sets[set].begin();
+        while (it != _sets[set].end() && it->tag != line) ++it;
+        return it;
+    }
+
+    VOID Insert(UINT32 set, ADDRINT line, UINT32 segments)
+    {
+        std::list<LINE> & lines = _sets[set];
+        while (lines.size() == TAGS || _free[set] < segments)
+        {
+            _free[set] += lines.back().segments;
+            lines.pop_back();
+            evictions++;
+        }
+        const LINE entry = { line, segments };
+        lines.push_front(entry);
+        _free[set] -= segments;
+    }
+
+  public:
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 evictions;
+
+    REFERENCE_COMPRESSED()
+      : _sets(COMPRESSED::max_sets), _free(COMPRESSED::max_sets, SEGMENTS),
+        hits(0), misses(0), evictions(0)
+    {}
+
+    bool Access(ADDRINT addr, UINT32 size)
+    {
+        bool allHit = true;
+        for (ADDRINT line = addr / COMPRESSED::lineSize; line <= (addr + size - 1) / COMPRESSED::lineSize; line++)
+        {
+            const UINT32 set = UINT32(line % COMPRESSED::max_sets);
+            std::list<LINE>::iterator it = Find(set, line);
+
+            if (it != _sets[set].end())
+            {
+                _sets[set].splice(_sets[set].begin(), _sets[set], it);
+            }
+            else
+            {
+                Insert(set, line, Segments(line));
+                allHit = false;
+            }
+        }
+        (allHit ? hits : misses)++;
+        return allHit;
+    }
+
+    /// A store to addr..addr+size-1 completed
+    VOID Update(ADDRINT addr, UINT32 size)
+    {
+        for (ADDRINT line = addr / COMPRESSED::lineSize; line <= (addr + size - 1) / COMPRESSED::lineSize; line++)
+        {
+            const UINT32 set = UINT32(line % COMPRESSED::max_sets);
+            std::list<LINE>::iterator it = Find(set, line);
+            if (it == _sets[set].end()) continue;
+
+            const UINT32 segments = Segments(line);
+            _free[set] += it->segments;
+            if (segments <= _free[set])
+            {
+                // resized in place, recency unchanged
+                it->segments = segments;
+                _free[set] -= segments;
+            }
+            else
+            {
+                _sets[set].erase(it);
+                Insert(set, line, segments);
+            }
+        }
+    }
+
+    COMPRESSED::LRU_CACHE::OCCUPANCY Occupancy() const
+    {
+        COMPRESSED::LRU_CACHE::OCCUPANCY occupancy = { 0, 0, 0 };
+        const UINT32 lineSegments = COMPRESSED::lineSize / CACHE_COMPRESS::SEGMENT_SIZE;
+
+        for (UINT32 set = 0; set < COMPRESSED::max_sets; set++)
+        {
+            for (std::list<LINE>::const_iterator it = _sets[set].begin(); it != _sets[set].end(); ++it)
+            {
+                occupancy.lines++;
+                occupancy.compressedLines += it->segments < lineSegments;
+                occupancy.segments += it->segments;
+            }
+        }
+        return occupancy;
+    }
+};
+
+const UINT32 REFERENCE_COMPRESSED::SEGMENTS;
+const UINT32 REFERENCE_COMPRESSED::TAGS;
+
+LOCALVAR UINT32 failures = 0;
+
+LOCALFUN VOID Expect(const std::string & what, UINT64 got, UINT64 expected)
+{
+    if (got == expected) return;
+
+    std::cout << "MISMATCH " << what << ": " << got << ", expected " << expected << std::endl;
+    failures++;
+}
+
+/*!
+ *  The SSE2 word classifier against the scalar one, on the edges of every
+ *  pattern and on random words, and whole lines whose zero runs cross the
+ *  groups of 4 words it works on.
+ */
+LOCALFUN VOID CheckWordBits(UINT32 seed)
+{
+    std::vector<UINT32> words;
+    const INT32 edges[] = { 0x7, 0x8, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff, 0x10000 };
+    for (UINT32 i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+    {
+        for (INT32 d = -1; d <= 1; d++)
+        {
+            words.push_back(UINT32(edges[i] + d));
+            words.push_back(UINT32(-edges[i] + d));
+            words.push_back(UINT32(edges[i] + d) << 16);
+        }
+    }
+    for (UINT32 b = 0; b < 0x100; b++)
+    {
+        words.push_back(b * 0x01010101U);
+        words.push_back(b * 0x01010101U ^ 1);
+        words.push_back(b << 24);
+        words.push_back(b * 0x00010001U);
+        words.push_back(UINT32(UINT8(b) | UINT32(UINT16(int8_t(b))) << 16));
+        words.push_back(UINT32(UINT16(int8_t(b))) | UINT32(UINT8(b + 0x7f)) << 16);
+    }
+    std::mt19937_64 rng(seed);
+    for (UINT32 i = 0; i < 64 * KILO; i++)
+    {
+        // random words, and random words that fit the narrower patterns
+        const UINT32 w = UINT32(rng());
+        words.push_back(w >> (rng() % 32));
+        words.push_back(UINT32(INT32(w) >> (rng() % 32)));
+    }
+    words.resize(words.size() & ~size_t(3));
+
+    UINT32 mismatches = 0;
+#if defined(__SSE2__)
+    for (size_t i = 0; i < words.size(); i += 4)
+    {
+        UINT32 zeros;
+        UINT32 bits[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(bits),
+                         CACHE_COMPRESS::WordBits4(reinterpret_cast<const UINT8 *>(&words[i]), zeros));
+        for (UINT32 j = 0; j < 4; j++)
+        {
+            const UINT32 expected = words[i + j] == 0 ? 0 : CACHE_COMPRESS::WordBits(words[i + j]);
+            if (bits[j] != expected || ((zeros >> j) & 1) != (words[i + j] == 0))
+            {
+                if (mismatches++ == 0)
+                {
+                    std::cout << "MISMATCH WordBits4 0x" << std::hex << words[i + j] << std::dec << ": " << bits[j]
+                              << ", expected " << expected << std::endl;
+                }
+            }
+        }
+    }
+#endif
+    Expect("WordBits4 mismatches", mismatches, 0);
+
+    // lines of up to 128 bytes, with zero runs of every length at every offset
+    const UINT32 lineWords = CACHE_COMPRESS::MAX_LINE_SIZE / sizeof(UINT32);
+    mismatches = 0;
+    for (UINT32 start = 0; start < lineWords; start++)
+    {
+        for (UINT32 length = 1; start + length <= lineWords; length++)
+        {
+            UINT32 line[lineWords];
+            for (UINT32 i = 0; i < lineWords; i++)
+            {
+                line[i] = i >= start && i < start + length ? 0 : words[rng() % words.size()];
+            }
+            for (UINT32 size = 4 * sizeof(UINT32); size <= sizeof(line); size *= 2)
+            {
+                UINT32 zeros = 0;
+                UINT32 expected = 0;
+                for (UINT32 i = 0; i < size / sizeof(UINT32); i++)
+                {
+                    if (line[i] == 0) zeros |= UINT32(1) << i;
+                    else expected += CACHE_COMPRESS::WordBits(line[i]);
+                }
+                expected += CACHE_COMPRESS::ZeroRunBits(zeros);
+                mismatches += CACHE_COMPRESS::LineBits(reinterpret_cast<const UINT8 *>(line), size) != expected;
+            }
+        }
+    }
+    Expect("LineBits mismatches", mismatches, 0);
+}
+
+/// FNV-1a over the lines covering size bytes at addr, as sink or memory holds them
+template <class LINES>
+LOCALFUN UINT64 LinesHash(const LINES & lines, ADDRINT addr, UINT32 size, bool & complete)
+{
+    UINT64 hash = 0xcbf29ce484222325ULL;
+    complete = true;
+    for (ADDRINT line = addr & ~ADDRINT(COMPRESSED::lineSize - 1); line < addr + size; line += COMPRESSED::lineSize)
+    {
+        UINT8 data[COMPRESSED::lineSize];
+        complete = lines.Get(line, data) && complete;
+        for (UINT32 i = 0; i < sizeof(data); i++) hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/// The synthetic memory as LinesHash() sees it
+struct MEMORY_LINES
+{
+    bool Get(ADDRINT line, UINT8 *data) const
+    {
+        memory.Read(line, data, COMPRESSED::lineSize);
+        return true;
+    }
+};
+
+/*!
+ *  @brief Replays one trace chunk with nothing known from earlier chunks
+ *
+ *  Every reference must find all its lines described by LINE events of the
+ *  chunk, with the contents the recorder saw.
+ */
+class CHUNK_SINK
+{
+  private:
+    std::map<ADDRINT, std::vector<UINT8> > _lines;
+    const std::vector<UINT64> & _expected;      // LinesHash() of every reference
+    size_t & _next;
+
+    VOID Reference(ADDRINT addr, UINT32 size)
+    {
+        bool complete;
+        const UINT64 hash = LinesHash(*this, addr, size, complete);
+
+        undescribed += !complete;
+        differing += complete && (_next >= _expected.size() || hash != _expected[_next]);
+        _next++;
+    }
+
+  public:
+    UINT64 undescribed;
+    UINT64 differing;
+
+    CHUNK_SINK(const std::vector<UINT64> & expected, size_t & next)
+      : _expected(expected), _next(next), undescribed(0), differing(0)
+    {}
+
+    bool Get(ADDRINT line, UINT8 *data) const
+    {
+        std::map<ADDRINT, std::vector<UINT8> >::const_iterator it = _lines.find(line);
+        if (it == _lines.end()) return false;
+        memcpy(data, &it->second[0], COMPRESSED::lineSize);
+        return true;
+    }
+
+    VOID Thread(UINT32 thread) {}
+    VOID Ins(ADDRINT addr) { Reference(addr, 1); }
+    VOID Mem(CACHE_TRACE::EVENT_KIND kind, ADDRINT addr, UINT32 size, bool store) { Reference(addr, size); }
+    VOID Line(ADDRINT lineAddr, const UINT8 *data)
+    {
+        _lines[lineAddr].assign(data, data + COMPRESSED::lineSize);
+    }
+};
+
+/*!
+ *  Record references of three threads over a small memory with
+ *  CACHE_TRACE::WRITER, then replay every chunk on its own: chunks must be
+ *  self-contained and give each reference the line contents it was
+ *  recorded with.
+ */
+LOCALFUN VOID CheckTrace(UINT64 seed)
+{
+    CHAR name[] = "/tmp/pin_cache_bench.XXXXXX";
+    const int fd = mkstemp(name);
+    if (fd < 0)
+    {
+        std::cout << "MISMATCH cannot create a trace file" << std::endl;
+        failures++;
+        return;
+    }
+    close(fd);
+
+    const UINT64 footprint = 256*KILO;
+    memory.Fill(footprint, 0.5, seed);
+    std::mt19937_64 rng(seed);
+    std::vector<UINT64> expected;
+
+    CACHE_TRACE::WRITER writer;
+    writer.Open(name, COMPRESSED::lineSize);
+    for (UINT32 i = 0; i < 400000; i++)
+    {
+        static const UINT32 sizes[] = { 1, 4, 8, 16, 32, 64 };
+        const ADDRINT addr = MEMORY::BASE + rng() % (footprint - COMPRESSED::lineSize);
+        const UINT32 size = sizes[rng() % (sizeof(sizes) / sizeof(sizes[0]))];
+        const bool store = Uniform(rng) < 0.3;
+        const CACHE_TRACE::EVENT_KIND kind = size == 1 ? CACHE_TRACE::EVENT_INS :
+            size <= 4 ? CACHE_TRACE::EVENT_MEM_SINGLE : CACHE_TRACE::EVENT_MEM_MULTI;
+        bool complete;
+
+        writer.Thread(i / 1000 % 3);
+        writer.BeginReference(addr, size);
+        for (ADDRINT line = addr & ~ADDRINT(COMPRESSED::lineSize - 1); line < addr + size; line += COMPRESSED::lineSize)
+        {
+            UINT8 data[COMPRESSED::lineSize];
+            memory.Read(line, data, sizeof(data));
+            writer.Line(line, data);
+        }
+        if (kind == CACHE_TRACE::EVENT_INS) writer.Ins(addr);
+        else writer.Mem(kind, addr, size, store);
+        expected.push_back(LinesHash(MEMORY_LINES(), addr, size, complete));
+
+        if (kind == CACHE_TRACE::EVENT_INS || !store) continue;
+
+        memory.Write(addr, MEMORY::Value(rng, Uniform(rng) < 0.5), size);
+        writer.BeginReference(addr, size);
+        for (ADDRINT line = addr & ~ADDRINT(COMPRESSED::lineSize - 1); line < addr + size; line += COMPRESSED::lineSize)
+        {
+            UINT8 data[COMPRESSED::lineSize];
+            memory.Read(line, data, sizeof(data));
+            writer.Line(line, data);
+        }
+        writer.Mem(CACHE_TRACE::EVENT_STORE_DONE, addr, size, true);
+        expected.push_back(LinesHash(MEMORY_LINES(), addr, size, complete));
+    }
+    const UINT64 events = writer.Events();
+    writer.Close();
+
+    std::vector<UINT8> file;
+    FILE *in = fopen(name, "rb");
+    for (int c; in != 0 && (c = fgetc(in)) != EOF; ) file.push_back(UINT8(c));
+    if (in != 0) fclose(in);
+    unlink(name);
+
+    // each chunk behind a copy of the file header, as a trace of its own
+    const size_t headerBytes = sizeof(CACHE_TRACE::FILE_HEADER);
+    size_t next = 0;
+    UINT64 chunks = 0;
+    UINT64 replayed = 0;
+    UINT64 undescribed = 0;
+    UINT64 differing = 0;
+    bool damaged = file.size() < headerBytes;
+    for (size_t offset = headerBytes; offset < file.size() && !damaged; chunks++)
+    {
+        CACHE_TRACE::CHUNK_HEADER header;
+        memcpy(&header, &file[offset], sizeof(header));
+        const size_t bytes = sizeof(header) + header.bytes;
+
+        std::vector<UINT8> chunk(file.begin(), file.begin() + headerBytes);
+        chunk.insert(chunk.end(), file.begin() + offset, file.begin() + offset + bytes);
+        offset += bytes;
+
+        CACHE_TRACE::READER reader;
+        CHUNK_SINK sink(expected, next);
+        damaged = !reader.Open(&chunk[0], chunk.size());
+        replayed += reader.Replay(sink);
+        damaged = damaged || reader.Damaged();
+        undescribed += sink.undescribed;
+        differing += sink.differing;
+    }
+
+    Expect("trace damaged", damaged, false);
+    Expect("trace has several chunks", chunks > 1, true);
+    Expect("trace events replayed", replayed, events);
+    Expect("trace references replayed", next, expected.size());
+    Expect("trace references to lines of other chunks", undescribed, 0);
+    Expect("trace references with other line contents", differing, 0);
+}
+
+/// Round robin cache against its reference on stream
+LOCALFUN VOID CheckRoundRobin(const OPTIONS & options, const STREAM & stream, bool singleLine)
+{
+    const UINT32 size = singleLine ? sizeof(UINT32) : options.size;
+    const std::string what = std::string("ROUND_ROBIN ") + (singleLine ? "AccessSingleLine " : "Access ") + stream.name;
+
+    RR::CACHE * cache = new RR::CACHE("bench", RR::cacheSize, RR::lineSize, RR::associativity);
+    DriveAccess(*cache, stream, singleLine, size);
+
+    REFERENCE_ROUND_ROBIN reference;
+    for (size_t i = 0; i < stream.refs.size(); i++)
+    {
+        reference.Access(stream.refs[i].addr, size, stream.refs[i].store);
+    }
+
+    Expect(what + " hits", cache->Hits(), reference.hits);
+    Expect(what + " misses", cache->Misses(), reference.misses);
+    delete cache;
+}
+
+/// LRU compressed cache against its reference on stream, each from a fresh memory
+LOCALFUN VOID CheckCompressed(const OPTIONS & options, const STREAM & stream, bool singleLine)
+{
+    const UINT32 size = singleLine ? sizeof(UINT32) : options.size;
+    const std::string what = std::string("LRU ") + (singleLine ? "SpecialAccessSingleLine " : "SpecialAccess ") + stream.name;
+
+    memory.Fill(options.footprint, options.compressible, options.seed);
+    COMPRESSED::LRU_CACHE * cache = new COMPRESSED::LRU_CACHE("bench",
+        COMPRESSED::cacheSize, COMPRESSED::lineSize, COMPRESSED::associativity);
+    DriveSpecial(*cache, stream, singleLine, size);
+
+    memory.Fill(options.footprint, options.compressible, options.seed);
+    REFERENCE_COMPRESSED * reference = new REFERENCE_COMPRESSED;
+    for (size_t i = 0; i < stream.refs.size(); i++)
+    {
+        const REF & ref = stream.refs[i];
+        reference->Access(ref.addr, size);
+        if (ref.store)
+        {
+            memory.Write(ref.addr, ref.value, size);
+            reference->Update(ref.addr, size);
+        }
+    }
+
+    const COMPRESSED::LRU_CACHE::OCCUPANCY got = cache->Occupancy();
+    const COMPRESSED::LRU_CACHE::OCCUPANCY expected = reference->Occupancy();
+    Expect(what + " hits", cache->Hits(), reference->hits);
+    Expect(what + " misses", cache->Misses(), reference->misses);
+    Expect(what + " evictions", cache->Evictions(), reference->evictions);
+    Expect(what + " lines", got.lines, expected.lines);
+    Expect(what + " compressed lines", got.compressedLines, expected.compressedLines);
+    Expect(what + " segments", got.segments, expected.segments);
+    delete cache;
+    delete reference;
+}
+
+/// Two sequential load passes over half of a compressed cache of incompressible lines
+template <class CACHE_TYPE>
+LOCALFUN VOID CheckTwoPasses(const std::string & set)
+{
+    // incompressible lines, so half of UL2 is half of its segments
+    const UINT32 bytes = COMPRESSED::cacheSize / 2;
+    memory.Fill(bytes, 0.0, 1);
+
+    STREAM stream;
+    for (UINT32 pass = 0; pass < 2; pass++)
+    {
+        for (UINT32 offset = 0; offset < bytes; offset += sizeof(UINT32))
+        {
+            const REF ref = { MEMORY::BASE + offset, 0, false };
+            stream.refs.push_back(ref);
+        }
+    }
+    CACHE_TYPE * cache = new CACHE_TYPE("bench", COMPRESSED::cacheSize, COMPRESSED::lineSize, COMPRESSED::associativity);
+    DriveSpecial(*cache, stream, true, sizeof(UINT32));
+    Expect(set + " two passes misses", cache->Misses(), bytes / COMPRESSED::lineSize);
+    Expect(set + " two passes hits", cache->Hits(), stream.refs.size() - bytes / COMPRESSED::lineSize);
+    Expect(set + " two passes evictions", cache->Evictions(), 0);
+    delete cache;
+}
+
+/// Counts of one cache and method on one stream of GoldenOptions()
+struct GOLDEN
+{
+    const char *set;
+    bool singleLine;
+    const char *stream;
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 evictions;
+};
+
+/// Fixed streams for the golden counts, independent of the command line
+LOCALFUN OPTIONS GoldenOptions()
+{
+    OPTIONS options;
+    options.check = true;
+    options.accesses = 200000;
+    options.footprint = 4*MEGA;
+    options.compressible = 0.5;
+    options.stores = 0.3;
+    options.size = 8;
+    options.stride = 4*KILO + 64;
+    options.zipf = 0.99;
+    options.seed = 1;
+    return options;
+}
+
+/*
+ * Recorded from this tree, with the LRU rows also matching REFERENCE_COMPRESSED.
+ * Changes to the sets, the policies or FPC that alter replacement show up
+ * here even if the reference models change along; update the table only
+ * for intended changes of behavior.
+ */
+LOCALVAR const GOLDEN goldenCounts[] =
+{
+    { "ROUND_ROBIN", true,  "sequential",  164530,   35470,       0 },
+    { "ROUND_ROBIN", false, "sequential",  164327,   35673,       0 },
+    { "LRU",         true,  "sequential",  187500,   12500,       0 },
+    { "LRU",         false, "sequential",  187499,   12501,       0 },
+    { "TREE_PLRU",   true,  "sequential",  187500,   12500,       0 },
+    { "TREE_PLRU",   false, "sequential",  187499,   12501,       0 },
+    { "RRIP",        true,  "sequential",  187500,   12500,       0 },
+    { "RRIP",        false, "sequential",  187499,   12501,       0 },
+    { "ROUND_ROBIN", true,  "strided",          0,  200000,       0 },
+    { "ROUND_ROBIN", false, "strided",          0,  200000,       0 },
+    { "LRU",         true,  "strided",      19244,  180756,  132737 },
+    { "LRU",         false, "strided",      18068,  181932,  134437 },
+    { "TREE_PLRU",   true,  "strided",      44361,  155639,  107636 },
+    { "TREE_PLRU",   false, "strided",      43629,  156371,  108816 },
+    { "RRIP",        true,  "strided",      27758,  172242,  122362 },
+    { "RRIP",        false, "strided",      26808,  173192,  123931 },
+    { "ROUND_ROBIN", true,  "random",        1530,  198470,       0 },
+    { "ROUND_ROBIN", false, "random",        1337,  198663,       0 },
+    { "LRU",         true,  "random",      115686,   84314,   37219 },
+    { "LRU",         false, "random",      114046,   85954,   42006 },
+    { "TREE_PLRU",   true,  "random",      115517,   84483,   37703 },
+    { "TREE_PLRU",   false, "random",      113875,   86125,   42512 },
+    { "RRIP",        true,  "random",      116073,   83927,   36647 },
+    { "RRIP",        false, "random",      114450,   85550,   41387 },
+    { "ROUND_ROBIN", true,  "zipf",         80846,  119154,       0 },
+    { "ROUND_ROBIN", false, "zipf",         76101,  123899,       0 },
+    { "LRU",         true,  "zipf",        166278,   33722,    1417 },
+    { "LRU",         false, "zipf",        165720,   34280,    1890 },
+    { "TREE_PLRU",   true,  "zipf",        166280,   33720,    1434 },
+    { "TREE_PLRU",   false, "zipf",        165726,   34274,    1898 },
+    { "RRIP",        true,  "zipf",        166309,   33691,    1380 },
+    { "RRIP",        false, "zipf",        165775,   34225,    1834 },
+};
+
+/// Run the cache named by golden on stream, from a fresh memory
+template <class CACHE_TYPE>
+LOCALFUN VOID CheckGoldenCompressed(const OPTIONS & options, const STREAM & stream, const GOLDEN & golden)
+{
+    const UINT32 size = golden.singleLine ? sizeof(UINT32) : options.size;
+    const std::string what = std::string(golden.set) + (golden.singleLine ? " SpecialAccessSingleLine " : " SpecialAccess ") + stream.name;
+
+    memory.Fill(options.footprint, options.compressible, options.seed);
+    CACHE_TYPE * cache = new CACHE_TYPE("bench", COMPRESSED::cacheSize, COMPRESSED::lineSize, COMPRESSED::associativity);
+    DriveSpecial(*cache, stream, golden.singleLine, size);
+
+    Expect("golden " + what + " hits", cache->Hits(), golden.hits);
+    Expect("golden " + what + " misses", cache->Misses(), golden.misses);
+    Expect("golden " + what + " evictions", cache->Evictions(), golden.evictions);
+    delete cache;
+}
+
+/*!
+ *  Fixed expectations that do not depend on the reference models. Two
+ *  sequential load passes over half of each cache miss once per line,
+ *  whatever the policy. And every cache, method and stream of
+ *  GoldenOptions() gives the counts in goldenCounts.
+ */
+LOCALFUN VOID CheckGolden()
+{
+    STREAM stream;
+    stream.name = "two passes";
+
+    const UINT32 rrBytes = RR::cacheSize / 2;
+    for (UINT32 pass = 0; pass < 2; pass++)
+    {
+        for (UINT32 offset = 0; offset < rrBytes; offset += sizeof(UINT32))
+        {
+            const REF ref = { MEMORY::BASE + offset, 0, false };
+            stream.refs.push_back(ref);
+        }
+    }
+    RR::CACHE * rr = new RR::CACHE("bench", RR::cacheSize, RR::lineSize, RR::associativity);
+    DriveAccess(*rr, stream, true, sizeof(UINT32));
+    Expect("ROUND_ROBIN two passes misses", rr->Misses(), rrBytes / RR::lineSize);
+    Expect("ROUND_ROBIN two passes hits", rr->Hits(), stream.refs.size() - rrBytes / RR::lineSize);
+    delete rr;
+
+    CheckTwoPasses<COMPRESSED::LRU_CACHE>("LRU");
+    CheckTwoPasses<COMPRESSED::PLRU_CACHE>("TREE_PLRU");
+    CheckTwoPasses<COMPRESSED::RRIP_CACHE>("RRIP");
+
+    const OPTIONS options = GoldenOptions();
+    const std::vector<STREAM> streams = MakeStreams(options);
+    for (size_t g = 0; g < sizeof(goldenCounts) / sizeof(goldenCounts[0]); g++)
+    {
+        const GOLDEN & golden = goldenCounts[g];
+        const std::string set = golden.set;
+        size_t s = 0;
+        while (s < streams.size() && streams[s].name != golden.stream) s++;
+        ASSERTX(s < streams.size());
+
+        if (set == "ROUND_ROBIN")
+        {
+            const UINT32 size = golden.singleLine ? sizeof(UINT32) : options.size;
+            const std::string what = set + (golden.singleLine ? " AccessSingleLine " : " Access ") + streams[s].name;
+
+            RR::CACHE * cache = new RR::CACHE("bench", RR::cacheSize, RR::lineSize, RR::associativity);
+            DriveAccess(*cache, streams[s], golden.singleLine, size);
+            Expect("golden " + what + " hits", cache->Hits(), golden.hits);
+            Expect("golden " + what + " misses", cache->Misses(), golden.misses);
+            delete cache;
+        }
+        else if (set == "LRU") CheckGoldenCompressed<COMPRESSED::LRU_CACHE>(options, streams[s], golden);
+        else if (set == "TREE_PLRU") CheckGoldenCompressed<COMPRESSED::PLRU_CACHE>(options, streams[s], golden);
+        else if (set == "RRIP") CheckGoldenCompressed<COMPRESSED::RRIP_CACHE>(options, streams[s], golden);
+        else ASSERTX(false);
+    }
+}
+
+LOCALFUN VOID Report(const std::string & set, const std::string & method, const STREAM & stream,
+                     FLT64 seconds, const CACHE_BASE & cache)
+{
+    const FLT64 accesses = FLT64(stream.refs.size());
+
+    std::cout << StringString(set, 12) << StringString(method, 25) << StringString(stream.name, 12)
+              << StringFlt(accesses / seconds / 1e6, 2, 10) << " M/s"
+              << StringFlt(seconds * 1e9 / accesses, 2, 10) << " ns"
+              << StringInt(cache.Hits(), 12) << StringInt(cache.Misses(), 12) << std::endl;
+}
+
+template <class CACHE_TYPE>
+LOCALFUN VOID BenchRoundRobin(const OPTIONS & options, const std::string & set, const STREAM & stream, bool singleLine)
+{
+    CACHE_TYPE * cache = new CACHE_TYPE("bench", RR::cacheSize, RR::lineSize, RR::associativity);
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    DriveAccess(*cache, stream, singleLine, options.size);
+    const std::chrono::duration<FLT64> elapsed = std::chrono::steady_clock::now() - start;
+
+    Report(set, singleLine ? "AccessSingleLine" : "Access", stream, elapsed.count(), *cache);
+    delete cache;
+}
+
+template <class CACHE_TYPE>
+LOCALFUN VOID BenchCompressed(const OPTIONS & options, const std::string & set, const STREAM & stream, bool singleLine)
+{
+    memory.Fill(options.footprint, options.compressible, options.seed);
+    CACHE_TYPE * cache = new CACHE_TYPE("bench", COMPRESSED::cacheSize, COMPRESSED::lineSize, COMPRESSED::associativity);
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    DriveSpecial(*cache, stream, singleLine, options.size);
+    const std::chrono::duration<FLT64> elapsed = std::chrono::steady_clock::now() - start;
+
+    Report(set, singleLine ? "SpecialAccessSingleLine" : "SpecialAccess", stream, elapsed.count(), *cache);
+    delete cache;
+}
+
+GLOBALFUN int main(int argc, char *argv[])
+{
+    OPTIONS options;
+    options.check = false;
+    options.accesses = 4000000;
+    options.footprint = 8*MEGA;
+    options.compressible = 0.5;
+    options.stores = 0.3;
+    options.size = 8;
+    options.stride = 4*KILO + 64;
+    options.zipf = 0.99;
+    options.seed = 1;
+
+    int arg = 1;
+    while (arg < argc)
+    {
+        const std::string option = argv[arg];
+        if (option == "-check")
+        {
+            options.check = true;
+            arg++;
+            continue;
+        }
+        if (arg + 1 >= argc) break;
+
+        const char *value = argv[arg + 1];
+        if (option == "-accesses") options.accesses = strtoull(value, 0, 10);
+        else if (option == "-footprint_kb") options.footprint = strtoull(value, 0, 10) * KILO;
+        else if (option == "-compressible") options.compressible = atof(value);
+        else if (option == "-stores") options.stores = atof(value);
+        else if (option == "-size") options.size = atoi(value);
+        else if (option == "-stride") options.stride = strtoull(value, 0, 10);
+        else if (option == "-zipf") options.zipf = atof(value);
+        else if (option == "-seed") options.seed = strtoull(value, 0, 10);
+        else break;
+        arg += 2;
+    }
+    if (arg != argc || options.accesses == 0 || options.size == 0 || options.size > RR::lineSize ||
+        options.footprint < COMPRESSED::lineSize || !IsPower2(UINT32(options.footprint / COMPRESSED::lineSize)))
+    {
+        std::cerr << "usage: " << argv[0] << " [-check] [-accesses <n>] [-footprint_kb <n>]"
+                  << " [-compressible <fraction>] [-stores <fraction>] [-size <bytes>]"
+                  << " [-stride <bytes>] [-zipf <theta>] [-seed <n>]" << std::endl
+                  << "  -footprint_kb must be a power of 2 lines, -size at most " << RR::lineSize << std::endl;
+        return 1;
+    }
+
+    CacheDataReader = ReadMemory;
+    const std::vector<STREAM> streams = MakeStreams(options);
+
+    if (options.check)
+    {
+        CheckWordBits(options.seed);
+        CheckTrace(options.seed);
+        CheckGolden();
+        for (size_t s = 0; s < streams.size(); s++)
+        {
+            CheckRoundRobin(options, streams[s], true);
+            CheckRoundRobin(options, streams[s], false);
+            CheckCompressed(options, streams[s], true);
+            CheckCompressed(options, streams[s], false);
+        }
+        std::cout << (failures == 0 ? "all results match" : "results differ") << std::endl;
+        return failures == 0 ? 0 : 1;
+    }
+
+    std::cout << StringString("set", 12) << StringString("method", 25) << StringString("stream", 12)
+              << StringString("accesses", 14) << StringString("per access", 13)
+              << StringString("hits", 12) << StringString("misses", 12) << std::endl;
+    for (size_t s = 0; s < streams.size(); s++)
+    {
+        BenchRoundRobin<RR::CACHE>(options, "ROUND_ROBIN", streams[s], true);
+        BenchRoundRobin<RR::CACHE>(options, "ROUND_ROBIN", streams[s], false);
+        BenchCompressed<COMPRESSED::LRU_CACHE>(options, "LRU", streams[s], true);
+        BenchCompressed<COMPRESSED::LRU_CACHE>(options, "LRU", streams[s], false);
+        BenchCompressed<COMPRESSED::PLRU_CACHE>(options, "TREE_PLRU", streams[s], true);
+        BenchCompressed<COMPRESSED::PLRU_CACHE>(options, "TREE_PLRU", streams[s], false);
+        BenchCompressed<COMPRESSED::RRIP_CACHE>(options, "RRIP", streams[s], true);
+        BenchCompressed<COMPRESSED::RRIP_CACHE>(options, "RRIP", streams[s], false);
+    }
+    return 0;
+}